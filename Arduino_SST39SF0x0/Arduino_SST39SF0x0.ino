@@ -9,8 +9,21 @@
 #define READ_DATA         (((PIND & 0b01111100) << 1) | (PINC & 0b00000111))
 #define LED(state)        bitWrite(PORTB, 5, state)   // Indicator LED
 
-int state=0;                      // state machine of Arduino programmer
-long readsize;                    // bytesize is transmitted by host programmer
+#define SOF               0xa5                        // start of frame: <SOF> <type> <seq> <len> <payload> <crc16>
+#define MAXPAYLOAD        64
+#define PROTOCOL          6                           // version of the framed host protocol
+
+#include <util/crc16.h>
+#include <avr/pgmspace.h>
+
+const unsigned long crc32c_nibbles[16] PROGMEM =  // CRC-32C (reflected 0x82F63B78), 4 bits at a time
+{
+  0x00000000, 0x105ec76f, 0x20bd8ede, 0x30e349b1, 0x417b1dbc, 0x5125dad3, 0x61c69362, 0x7198540d,
+  0x82f63b78, 0x92a8fc17, 0xa24bb5a6, 0xb21572c9, 0xc38d26c4, 0xd3d3e1ab, 0xe330a81a, 0xf36e6f75
+};
+
+byte payload[MAXPAYLOAD];         // payload of the last received frame
+unsigned long baudtimer = 0;      // set after a baud rate change until the first frame arrives
 
 void setup()
 {
@@ -23,80 +36,197 @@ void setup()
 
 void loop()
 {
-  switch(state)
+  byte type, seq, len;
+  if (baudtimer != 0 && millis() - baudtimer > 1000)  // host can't talk at the new baud rate: fall back
+  {
+    Serial.end(); Serial.begin(115200, SERIAL_8N1); baudtimer = 0;
+  }
+  int r = ReadFrame(type, seq, len);
+  if (r == 0) return;                                 // nothing received yet
+  if (r < 0) { SendFrame('N', seq, 0, 0); return; }   // damaged frame: ask for retransmission
+  baudtimer = 0;
+  switch(type)
   {
-    default: // waiting for handshake 'a'
+    case 'I': // chip ID and protocol version
     {
-      if (Serial.available() > 0)
-      {
-        if (Serial.read() == 'a')  // confirm first handshake
-        {
-          Serial.write('A');
-          readsize = 0;
-          LED(HIGH);
-          state = 1;
-        }
-        else state = 0;
-      }
+      byte id[3];
+      ReadID(id[0], id[1]);
+      id[2] = PROTOCOL;
+      SendFrame('I', seq, id, 3);
       break;
     }
-    case 1: // waiting for bytesize and handshake 'b'
+    case 'E': // completely erase the FLASH IC
     {
-      if (Serial.available() > 0)
-      {
-        char c = Serial.read();
-        if (c >= '0' && c <= '9') { readsize = readsize*10 + c - '0'; Serial.write(c); } // echo
-        else if (c == 'b') { Serial.write('B'); state = 2; break; } // confirm received bytesize
-        else state = 0;
-      }
+      LED(HIGH);
+      byte ok = EraseFLASH();
+      SendFrame('E', seq, &ok, 1);
       break;
-    }  
-    case 2: // receiving and writing data to FLASH
+    }
+    case 'S': // erase the 4KB sector containing <adr:3>
     {
-      LED(LOW);
-      if (EraseFLASH() == true) // completely erase the FLASH IC first
-      {
-        Serial.write('C');
-        long adr = 0; // always commence writing at address zero
-        do
-        {
-          byte chunk[32];
-          int p=0;
-          long lastmillis = millis();
-          do
-          {
-            if (Serial.available() > 0)
-            {
-              chunk[p++] = Serial.read(); lastmillis = millis();
-            }
-          } while (p < 32 && millis() - lastmillis < 500);
-
-          if (p > 0)                                 // received some data?
-          {
-            for(int i=0; i<p; i++) WriteFLASH(adr++, chunk[i]);
-            Serial.write('D');
-          }
-        } while (adr < readsize);
-        state = 3;
-      } else state = 0;
+      if (len != 3) { SendFrame('N', seq, 0, 0); break; }
+      byte ok = EraseSector(payload[0] | long(payload[1]) << 8 | long(payload[2]) << 16);
+      SendFrame('S', seq, &ok, 1);
       break;
     }
-    case 3: // readout FLASH and send back the data for verification
+    case 'W': // write a chunk to <adr:3> and answer with the CRC-16 of what has actually been written
     {
-      LED(HIGH);
-      ToRead();
-      SET_OE(LOW);                                    // activate EEPROM outputs
-      for(long i=0; i<readsize; i++)
+      if (len < 3) { SendFrame('N', seq, 0, 0); break; }
+      long adr = payload[0] | long(payload[1]) << 8 | long(payload[2]) << 16;
+      for(byte i=3; i<len; i++) WriteFLASH(adr + i - 3, payload[i]);
+      unsigned int crc = ReadCrc(adr, len - 3);
+      byte ack[2] = { byte(crc & 0xff), byte(crc >> 8) };
+      SendFrame('W', seq, ack, 2);
+      break;
+    }
+    case 'B': // check that <len:2> bytes from <adr:3> are erased (0xff runs are not sent)
+    {
+      if (len != 5) { SendFrame('N', seq, 0, 0); break; }
+      byte ok = IsBlank(payload[0] | long(payload[1]) << 8 | long(payload[2]) << 16, payload[3] | payload[4] << 8);
+      SendFrame('B', seq, &ok, 1);
+      break;
+    }
+    case 'H': // CRC-32C and 16-bit sum of <len:2> bytes from <adr:3>, nothing is changed
+    {
+      if (len != 5) { SendFrame('N', seq, 0, 0); break; }
+      unsigned int sum;
+      unsigned long crc = ReadHash(payload[0] | long(payload[1]) << 8 | long(payload[2]) << 16, payload[3] | payload[4] << 8, sum);
+      byte hash[6] = { byte(crc), byte(crc >> 8), byte(crc >> 16), byte(crc >> 24), byte(sum & 0xff), byte(sum >> 8) };
+      SendFrame('H', seq, hash, 6);
+      break;
+    }
+    case 'X': // link test: echo the payload
+    {
+      SendFrame('X', seq, payload, len);
+      break;
+    }
+    case 'Y': // link test: swallow the payload
+    {
+      SendFrame('Y', seq, &len, 1);
+      break;
+    }
+    case 'Z': // link test: send <n> bytes
+    {
+      byte n = (len == 1 && payload[0] <= MAXPAYLOAD) ? payload[0] : 0;
+      for (byte i=0; i<n; i++) payload[i] = i;
+      SendFrame('Z', seq, payload, n);
+      break;
+    }
+    case 'R': // switch to baud rate <baud:4>
+    {
+      long baud = payload[0] | long(payload[1]) << 8 | long(payload[2]) << 16 | long(payload[3]) << 24;
+      byte ok = len == 4 && (baud == 57600 || baud == 115200 || baud == 230400 || baud == 500000 || baud == 1000000);
+      SendFrame('R', seq, &ok, 1);
+      if (ok)
       {
-        SetAddress(i);
-        Serial.write(READ_DATA);
+        Serial.flush();                               // the answer still goes out at the old rate
+        Serial.end(); Serial.begin(baud, SERIAL_8N1);
+        baudtimer = millis() | 1;
       }
-      SET_OE(HIGH);                                   // deactivate EEPROM outputs
+      break;
+    }
+    case 'F': // job finished
+    {
       LED(LOW);
-      state = 0;
+      SendFrame('F', seq, 0, 0);
       break;
     }
+    default: SendFrame('?', seq, 0, 0); break;       // unknown command
+  }
+}
+
+// returns 1 for a complete frame, -1 for a damaged one and 0 if no frame has started
+int ReadFrame(byte& type, byte& seq, byte& len)
+{
+  seq = 0;
+  if (Serial.available() == 0) return 0;
+  int c = Serial.read();
+  if (c == 'a') { Serial.write('A'); return 0; }      // the handshake stays a single byte
+  if (c != SOF) return 0;
+  int t = ReadByte(100), s = ReadByte(100), l = ReadByte(100);
+  if (t < 0 || s < 0 || l < 0) return -1;
+  type = t; seq = s; len = l;
+  if (len > MAXPAYLOAD) return -1;
+  unsigned int crc = 0;
+  crc = _crc_xmodem_update(crc, type);
+  crc = _crc_xmodem_update(crc, seq);
+  crc = _crc_xmodem_update(crc, len);
+  for (byte i=0; i<len; i++)
+  {
+    int d = ReadByte(100);
+    if (d < 0) return -1;
+    payload[i] = d;
+    crc = _crc_xmodem_update(crc, d);
+  }
+  int lo = ReadByte(100), hi = ReadByte(100);
+  if (lo < 0 || hi < 0 || crc != (unsigned int)(lo | (hi << 8))) return -1;
+  return 1;
+}
+
+void SendFrame(byte type, byte seq, const byte* data, byte len)
+{
+  unsigned int crc = 0;
+  crc = _crc_xmodem_update(crc, type);
+  crc = _crc_xmodem_update(crc, seq);
+  crc = _crc_xmodem_update(crc, len);
+  for (byte i=0; i<len; i++) crc = _crc_xmodem_update(crc, data[i]);
+  Serial.write(SOF); Serial.write(type); Serial.write(seq); Serial.write(len);
+  Serial.write(data, len);
+  Serial.write(crc & 0xff); Serial.write(crc >> 8);
+}
+
+int ReadByte(long timeout)
+{
+  long lastmillis = millis();
+  while (Serial.available() == 0) if (millis() - lastmillis >= timeout) return -1;
+  return Serial.read();
+}
+
+unsigned int ReadCrc(long adr, int n)
+{
+  unsigned int crc = 0;
+  ToRead();
+  SET_OE(LOW);                                    // activate FLASH outputs
+  for(int i=0; i<n; i++)
+  {
+    SetAddress(adr + i);
+    crc = _crc_xmodem_update(crc, READ_DATA);
+  }
+  SET_OE(HIGH);                                   // deactivate FLASH outputs
+  return crc;
+}
+
+unsigned long ReadHash(long adr, unsigned int n, unsigned int& sum)
+{
+  unsigned long crc = 0xffffffff;
+  sum = 0;
+  ToRead();
+  SET_OE(LOW);                                    // activate FLASH outputs
+  for(unsigned int i=0; i<n; i++)
+  {
+    SetAddress(adr + i);
+    byte data = READ_DATA;
+    sum += data;
+    crc ^= data;
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32c_nibbles[crc & 15]);
+    crc = (crc >> 4) ^ pgm_read_dword(&crc32c_nibbles[crc & 15]);
+  }
+  SET_OE(HIGH);                                   // deactivate FLASH outputs
+  return ~crc;
+}
+
+bool IsBlank(long adr, unsigned int n)
+{
+  byte all = 0xff;
+  ToRead();
+  SET_OE(LOW);                                    // activate FLASH outputs
+  for(unsigned int i=0; i<n && all == 0xff; i++)
+  {
+    SetAddress(adr + i);
+    all &= READ_DATA;
   }
+  SET_OE(HIGH);                                   // deactivate FLASH outputs
+  return all == 0xff;
 }
 
 void SetAddress(long adr)
@@ -144,6 +274,40 @@ bool EraseFLASH()
   return c < 2000; // SUCCESS condition
 }
 
+bool EraseSector(long adr)
+{
+  SET_OE(HIGH);
+  SetAddress(0x5555); WriteTo(0xaa); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);   // invoke 'Sector Erase' command
+  SetAddress(0x2aaa); WriteTo(0x55); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(0x5555); WriteTo(0x80); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(0x5555); WriteTo(0xaa); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(0x2aaa); WriteTo(0x55); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(adr);    WriteTo(0x30); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  ToRead();
+  SET_OE(LOW);
+  int c = 0; while ((READ_DATA & 128) != 128 && c < 500) { c++; delayMicroseconds(100); }    // typ. 18ms
+  SET_OE(HIGH);
+  return c < 500; // SUCCESS condition
+}
+
+void ReadID(byte& manufacturer, byte& device)
+{
+  SET_OE(HIGH);
+  SetAddress(0x5555); WriteTo(0xaa); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);   // enter 'Software ID' mode
+  SetAddress(0x2aaa); WriteTo(0x55); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(0x5555); WriteTo(0x90); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  ToRead();
+  delayMicroseconds(1);
+  SET_OE(LOW);
+  SetAddress(0); manufacturer = READ_DATA;       // 0xbf = SST
+  SetAddress(1); device = READ_DATA;             // 0xb5, 0xb6, 0xb7 = SST39SF010A, 020A, 040
+  SET_OE(HIGH);
+  SetAddress(0x5555); WriteTo(0xaa); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);   // leave 'Software ID' mode
+  SetAddress(0x2aaa); WriteTo(0x55); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  SetAddress(0x5555); WriteTo(0xf0); SET_WE(HIGH); SET_WE(LOW); SET_WE(HIGH);
+  ToRead();
+}
+
 bool WriteFLASH(long adr, byte data)
 {
   SET_WE(HIGH);
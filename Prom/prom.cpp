@@ -2,21 +2,129 @@
 // ported to Linux by Carsten Herting (2025)
 
 // Build on Windows: g++ -O2 -oprom.exe prom.cpp -s
-// Build on Linux: g++ -O2 -oprom prom.cpp -s
+// Build on Linux: g++ -O2 -oprom prom.cpp -s -pthread
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
 #include <string>
 #include <chrono>
 #include <vector>
 #include <thread>
+#include <future>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <nmmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+  #include <arm_acle.h>
+#endif
+
+const int SECTORSIZE = 4096;                    // smallest erasable unit of SST39SF0x0A
+const int MAXRETRIES = 3;                       // rewrite attempts per chunk on checksum mismatch
+const int CHUNKSIZE = 32;                       // data bytes per write frame
+const int WINDOW = 2;                           // write frames in flight (the Arduino buffers 64 bytes)
+const int MAXREPAIRS = 3;                       // sector erase & rewrite rounds for chunks that keep failing
+const int MAXSENDS = 8;                         // transmissions of a frame before the link counts as broken
+const int MINBLANK = 256;                       // 0xff runs of at least this size are blank-checked on the chip instead of written
+const int PROTOCOL = 6;                         // version of the framed protocol the sketch must speak
+
+// Binary trace of the serial traffic. Record() only copies into a ring buffer, a background thread writes it to disk.
+// File format: "PROMTRC1", then records of <dir:1> <bytesize:2> <microseconds:8> <payload> (little endian).
+class CTrace
+{
+public:
+  enum { TX = 'T', RX = 'R', MARK = 'M' };
+  CTrace() : mRing(1 << 20), mWritePos(0), mReadPos(0), mDropped(0), mStop(false) {}
+  ~CTrace() { Close(); }
+  bool Open(const std::string& filename)
+  {
+    mFile.open(filename, std::ios::binary | std::ios::trunc);
+    if (!mFile) return false;
+    mFile.write("PROMTRC1", 8);
+    mStart = std::chrono::steady_clock::now();
+    mStop = false;
+    mWriter = std::thread(&CTrace::Writer, this);
+    return true;
+  }
+  void Close()
+  {
+    if (!mWriter.joinable()) return;
+    if (mDropped > 0) { std::string m = "dropped " + std::to_string(mDropped.load()); Record(MARK, m.c_str(), int(m.size())); }
+    mStop = true;
+    mWriter.join();
+    mFile.close();
+  }
+  void Record(char dir, const void* data, int bytesize)
+  {
+    if (bytesize <= 0 || !mWriter.joinable()) return;
+    bytesize = std::min(bytesize, 0xffff);
+    uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - mStart).count();
+    size_t w = mWritePos.load(std::memory_order_relaxed), r = mReadPos.load(std::memory_order_acquire);
+    if (mRing.size() - (w - r) < size_t(11 + bytesize)) { ++mDropped; return; }
+    unsigned char head[11] = { (unsigned char)dir, (unsigned char)bytesize, (unsigned char)(bytesize >> 8) };
+    for (int i = 0; i < 8; ++i) head[3 + i] = (unsigned char)(us >> (8 * i));
+    Put(w, head, 11);
+    Put(w + 11, static_cast<const unsigned char*>(data), bytesize);
+    mWritePos.store(w + 11 + bytesize, std::memory_order_release);
+  }
+private:
+  void Put(size_t pos, const unsigned char* data, int len)
+  {
+    for (int i = 0; i < len; ++i) mRing[(pos + i) & (mRing.size() - 1)] = data[i];
+  }
+  void Writer()
+  {
+    bool stop;
+    do
+    {
+      stop = mStop;                             // drain once more after Close() has been requested
+      size_t r = mReadPos.load(std::memory_order_relaxed), w = mWritePos.load(std::memory_order_acquire);
+      while (r < w)
+      {
+        size_t at = r & (mRing.size() - 1), len = std::min(w - r, mRing.size() - at);
+        mFile.write(reinterpret_cast<const char*>(&mRing[at]), len);
+        r += len;
+      }
+      mReadPos.store(r, std::memory_order_release);
+      mFile.flush();
+      if (!stop) std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    } while (!stop);
+  }
+  std::vector<unsigned char> mRing;             // size must be a power of two
+  std::atomic<size_t> mWritePos, mReadPos;
+  std::atomic<int> mDropped;
+  std::atomic<bool> mStop;
+  std::chrono::steady_clock::time_point mStart;
+  std::ofstream mFile;
+  std::thread mWriter;
+};
+
+struct PortInfo { std::string device, vid, pid, serial, product; bool known; };
+
+// USB VID:PID of the boards and USB-serial adapters the programmer is usually built with
+bool IsProgrammer(const std::string& vid, const std::string& pid)
+{
+  static const char* ids[][2] =
+  {
+    { "2341", "*" }, { "2a03", "*" }, { "1a86", "7523" }, { "1a86", "55d4" }, { "0403", "6001" }, { "0403", "6015" }, { "10c4", "ea60" }
+  };
+  for (const auto& id : ids) if (vid == id[0] && (pid == id[1] || id[1][0] == '*')) return true;
+  return false;
+}
 
 #if defined(_WIN32)
+  #define NOMINMAX
   #include <windows.h>
   class CSerial
   {
   public:
-    CSerial() { mComHandle = INVALID_HANDLE_VALUE; }
+    CSerial() { mComHandle = INVALID_HANDLE_VALUE; mTrace = nullptr; }
     ~CSerial() { Close(); }
     bool Open(int portnumber, int bitRate)
     {
@@ -55,6 +163,7 @@
       if (mComHandle == INVALID_HANDLE_VALUE) return 0;
       DWORD numWritten = 0;
       WriteFile(mComHandle, buffer.c_str(), DWORD(buffer.size()), &numWritten, nullptr);
+      if (mTrace) mTrace->Record(CTrace::TX, buffer.c_str(), int(numWritten));
       return int(numWritten);
     }
     int SendData(const char* buffer, int bytesize)
@@ -62,6 +171,7 @@
       if (mComHandle == INVALID_HANDLE_VALUE) return 0;
       DWORD numWritten = 0;
       WriteFile(mComHandle, buffer, DWORD(bytesize), &numWritten, nullptr);
+      if (mTrace) mTrace->Record(CTrace::TX, buffer, int(numWritten));
       return int(numWritten);
     }
     int SendByte(unsigned char ch)
@@ -69,6 +179,7 @@
       if (mComHandle == INVALID_HANDLE_VALUE) return 0;
       DWORD numWritten = 0;
       WriteFile(mComHandle, &ch, 1, &numWritten, nullptr);
+      if (mTrace) mTrace->Record(CTrace::TX, &ch, int(numWritten));
       return (numWritten == 1 ? 1 : 0);
     }
     int ReadData(unsigned char* buffer, int buffLimit)
@@ -76,6 +187,7 @@
       if (mComHandle == INVALID_HANDLE_VALUE) return 0;
       DWORD numRead = 0;
       ReadFile(mComHandle, buffer, DWORD(buffLimit), &numRead, NULL);
+      if (mTrace) mTrace->Record(CTrace::RX, buffer, int(numRead));
       return int(numRead);
     }
     void Flush()
@@ -102,8 +214,69 @@
       }
       return -1;
     }
+    static std::vector<PortInfo> ListPorts()      // present COM ports, USB IDs aren't looked up on Windows
+    {
+      std::vector<PortInfo> ports;
+      char buffer[100];
+      for (int i = 0; i < 256; ++i)
+      {
+        std::string name = "COM" + std::to_string(i);
+        if (QueryDosDeviceA(name.c_str(), buffer, sizeof(buffer)) != 0) ports.push_back({ name, "", "", "", buffer, false });
+      }
+      return ports;
+    }
+    bool SetBaud(int bitRate)
+    {
+      DCB dcb;
+      SecureZeroMemory(&dcb, sizeof(dcb));
+      dcb.DCBlength = sizeof(dcb);
+      if (mComHandle == INVALID_HANDLE_VALUE || !GetCommState(mComHandle, &dcb)) return false;
+      dcb.BaudRate = bitRate;
+      return SetCommState(mComHandle, &dcb) != 0;
+    }
+    std::vector<std::string> SetLowLatency()
+    {
+      return { "not supported on Windows (set the adapter's latency timer in the device manager)" };
+    }
+    void SetTrace(CTrace* trace) { mTrace = trace; }
+    void Mark(const std::string& phase) { if (mTrace) mTrace->Record(CTrace::MARK, phase.c_str(), int(phase.size())); }
   private:
     HANDLE mComHandle;
+    CTrace* mTrace;
+  };
+
+  class CImageFile                                // read-only memory mapping of an image file
+  {
+  public:
+    CImageFile() { mFile = mMap = INVALID_HANDLE_VALUE; mData = nullptr; mSize = 0; }
+    ~CImageFile() { Close(); }
+    bool Open(const std::string& filename)
+    {
+      mFile = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+      if (mFile == INVALID_HANDLE_VALUE) return false;
+      LARGE_INTEGER size;
+      if (!GetFileSizeEx(mFile, &size)) { Close(); return false; }
+      mSize = size_t(size.QuadPart);
+      if (mSize == 0) return true;
+      mMap = CreateFileMappingA(mFile, NULL, PAGE_READONLY, 0, 0, NULL);
+      if (mMap == NULL) { mMap = INVALID_HANDLE_VALUE; Close(); return false; }
+      mData = static_cast<const unsigned char*>(MapViewOfFile(mMap, FILE_MAP_READ, 0, 0, 0));
+      if (mData == nullptr) { Close(); return false; }
+      return true;
+    }
+    void Close()
+    {
+      if (mData != nullptr) UnmapViewOfFile(mData);
+      if (mMap != INVALID_HANDLE_VALUE) CloseHandle(mMap);
+      if (mFile != INVALID_HANDLE_VALUE) CloseHandle(mFile);
+      mFile = mMap = INVALID_HANDLE_VALUE; mData = nullptr; mSize = 0;
+    }
+    const unsigned char* Data() const { return mData; }
+    size_t Size() const { return mSize; }
+  private:
+    HANDLE mFile, mMap;
+    const unsigned char* mData;
+    size_t mSize;
   };
 
 #elif defined(__linux__)
@@ -111,13 +284,21 @@
   #include <fcntl.h>
   #include <unistd.h>
   #include <sys/ioctl.h>
+  #include <sys/mman.h>
+  #include <sys/stat.h>
+  #include <poll.h>
+  #include <cerrno>
+  #include <climits>
+  #include <linux/serial.h>
+  #include <dirent.h>
+  #include <csignal>
   #include <cstdio>
   #include <cstring>
 
   class CSerial
   {
   public:
-    CSerial() { m_fd = -1; }
+    CSerial() { m_fd = -1; m_trace = nullptr; m_lowlatency = false; m_serialflags = -1; m_latencytimer = -1; }
     ~CSerial() { Close(); }
     bool Open(int portnumber, int bitRate)
     {
@@ -132,6 +313,7 @@
       termios tty = {};
       if (tcgetattr(m_fd, &tty) != 0) { Close(); return false; }
       m_orig = tty; // store original setting so we can restore at the end of the program
+      if (MapBaud(bitRate) == B0) { Close(); return false; }
       cfsetospeed(&tty, MapBaud(bitRate));
       cfsetispeed(&tty, MapBaud(bitRate));
       tty.c_cflag  = (tty.c_cflag & ~CSIZE) | CS8;
@@ -154,6 +336,7 @@
     {
       if (m_fd >= 0)
       {
+        RestoreLatency();
         tcsetattr(m_fd, TCSANOW, &m_orig);
         ::close(m_fd);
         m_fd = -1;
@@ -162,26 +345,38 @@
     }
     int SendData(const std::string& buf)
     {
-      if (m_fd < 0) return 0;
-      ssize_t n = ::write(m_fd, buf.c_str(), buf.size());
-      return (n < 0 ? 0 : int(n));
+      return SendData(buf.c_str(), int(buf.size()));
     }
     int SendData(const char* buf, int len)
     {
       if (m_fd < 0) return 0;
-      ssize_t n = ::write(m_fd, buf, len);
-      return (n < 0 ? 0 : int(n));
+      int n = 0;
+      while (n < len)                           // the port is non-blocking: wait for room instead of dropping bytes
+      {
+        ssize_t r = ::write(m_fd, buf + n, len - n);
+        if (r > 0) { n += int(r); continue; }
+        if (r < 0 && errno != EAGAIN && errno != EINTR) break;
+        pollfd p = { m_fd, POLLOUT, 0 };
+        if (::poll(&p, 1, 1000) <= 0) break;
+      }
+      if (m_lowlatency)                         // return when the bytes have left the kernel, not just entered it
+      {
+        int queued = 0;
+        for (int i = 0; i < 10000 && ioctl(m_fd, TIOCOUTQ, &queued) == 0 && queued > 0; ++i)
+          std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+      if (m_trace) m_trace->Record(CTrace::TX, buf, n);
+      return n;
     }
     int SendByte(unsigned char ch)
     {
-      if (m_fd < 0) return 0;
-      ssize_t n = ::write(m_fd, &ch, 1);
-      return (n < 0 ? 0 : 1);
+      return SendData(reinterpret_cast<const char*>(&ch), 1);
     }
     int ReadData(unsigned char* buf, int maxlen)
     {
       if (m_fd < 0) return 0;
       ssize_t n = ::read(m_fd, buf, maxlen);
+      if (m_trace) m_trace->Record(CTrace::RX, buf, int(n));
       return (n < 0 ? 0 : int(n));
     }
     void Flush()
@@ -198,20 +393,108 @@
     }
     std::string GetFirstComPort()
     {
-      const char* prefixes[] = { "/dev/ttyUSB", "/dev/ttyACM", "/dev/ttyS" };
-      char path[32];
-      for (auto p : prefixes)
+      std::vector<PortInfo> ports = ListPorts();
+      return ports.empty() ? std::string() : ports[0].device;
+    }
+    // USB serial ports from /sys/class/tty, known programmer adapters first
+    static std::vector<PortInfo> ListPorts()
+    {
+      std::vector<PortInfo> ports;
+      DIR* dir = ::opendir("/sys/class/tty");
+      if (dir == nullptr) return ports;
+      while (dirent* entry = ::readdir(dir))
       {
-        for (int i = 0; i < 256; ++i)
-        {
-          std::snprintf(path, sizeof(path), "%s%d", p, i);
-          if (::access(path, R_OK | W_OK) == 0) return std::string(path);
-        }
+        std::string name = entry->d_name;
+        char real[PATH_MAX];
+        if (name[0] == '.' || ::realpath(("/sys/class/tty/" + name + "/device").c_str(), real) == nullptr) continue;
+        std::string usb = real;                   // walk up from the interface to the USB device
+        while (usb.size() > 1 && ::access((usb + "/idVendor").c_str(), R_OK) != 0) usb = usb.substr(0, usb.find_last_of('/'));
+        if (usb.size() <= 1) continue;            // not a USB serial port
+        PortInfo port = { "/dev/" + name, ReadLine(usb + "/idVendor"), ReadLine(usb + "/idProduct"), ReadLine(usb + "/serial"), ReadLine(usb + "/product"), false };
+        port.known = IsProgrammer(port.vid, port.pid);
+        ports.push_back(port);
       }
-      return {};
+      ::closedir(dir);
+      std::sort(ports.begin(), ports.end(), [](const PortInfo& a, const PortInfo& b)
+      {
+        return a.known != b.known ? a.known : a.device.size() != b.device.size() ? a.device.size() < b.device.size() : a.device < b.device;
+      });
+      return ports;
+    }
+    // accepts a device path, a tty name or the USB serial number of the adapter
+    static std::string ResolvePort(const std::string& port)
+    {
+      if (port.empty() || port[0] == '/') return port;
+      for (const PortInfo& p : ListPorts()) if (p.serial == port) return p.device;
+      return "/dev/" + port;
     }
     std::string DevicePath() const { return m_device; }
+    bool SetBaud(int bitRate)
+    {
+      termios tty = {};
+      if (m_fd < 0 || MapBaud(bitRate) == B0 || tcgetattr(m_fd, &tty) != 0) return false;
+      cfsetospeed(&tty, MapBaud(bitRate));
+      cfsetispeed(&tty, MapBaud(bitRate));
+      return tcsetattr(m_fd, TCSADRAIN, &tty) == 0;
+    }
+    // Opt-in tuning for USB-serial adapters, returns what could be changed. Everything is restored by Close()
+    // or, if Ctrl+C, SIGTERM or SIGHUP ends the program first, by the signal handler.
+    std::vector<std::string> SetLowLatency()
+    {
+      std::vector<std::string> report;
+      if (m_fd < 0) return report;
+      m_lowlatency = true;
+      serial_struct ss;
+      if (ioctl(m_fd, TIOCGSERIAL, &ss) != 0) report.push_back("ASYNC_LOW_LATENCY: not supported by driver");
+      else if (ss.flags & ASYNC_LOW_LATENCY) report.push_back("ASYNC_LOW_LATENCY: already set");
+      else
+      {
+        int flags = ss.flags;
+        ss.flags |= ASYNC_LOW_LATENCY;
+        if (ioctl(m_fd, TIOCSSERIAL, &ss) != 0) report.push_back(std::string("ASYNC_LOW_LATENCY: ") + std::strerror(errno));
+        else { m_serialflags = flags; report.push_back("ASYNC_LOW_LATENCY: set"); }
+      }
+      // FTDI adapters hold back received bytes for up to latency_timer ms (default 16)
+      char real[PATH_MAX];
+      if (::realpath(m_device.c_str(), real) != nullptr)
+      {
+        std::string name = real;
+        m_latencypath = "/sys/class/tty/" + name.substr(name.find_last_of('/') + 1) + "/device/latency_timer";
+      }
+      std::ifstream in(m_latencypath);
+      int timer = -1;
+      if (!(in >> timer)) report.push_back("latency_timer: not available");
+      else if (timer <= 1) report.push_back("latency_timer: already " + std::to_string(timer) + " ms");
+      else
+      {
+        std::ofstream out(m_latencypath);
+        if (!(out << 1 << std::flush)) report.push_back("latency_timer: " + std::to_string(timer) + " ms, no permission to change it");
+        else { m_latencytimer = timer; report.push_back("latency_timer: " + std::to_string(timer) + " ms -> 1 ms"); }
+      }
+      report.push_back("TIOCOUTQ: " + std::string(ioctl(m_fd, TIOCOUTQ, &timer) == 0 ? "writes wait for the output queue to drain" : "not supported by driver"));
+      if (m_serialflags >= 0 || m_latencytimer >= 0)
+      {
+        SavedLatency& saved = Saved();
+        saved.flags = m_serialflags;
+        std::snprintf(saved.path, sizeof(saved.path), "%s", m_latencypath.c_str());
+        std::snprintf(saved.timer, sizeof(saved.timer), "%s", m_latencytimer >= 0 ? std::to_string(m_latencytimer).c_str() : "");
+        saved.fd = m_fd;
+        struct sigaction sa = {};
+        sa.sa_handler = OnSignal;
+        for (int sig : { SIGINT, SIGTERM, SIGHUP }) sigaction(sig, &sa, nullptr);
+      }
+      return report;
+    }
+    void SetTrace(CTrace* trace) { m_trace = trace; }
+    void Mark(const std::string& phase) { if (m_trace) m_trace->Record(CTrace::MARK, phase.c_str(), int(phase.size())); }
   private:
+    static std::string ReadLine(const std::string& filename)
+    {
+      std::ifstream file(filename);
+      std::string line;
+      std::getline(file, line);
+      return line;
+    }
     static speed_t MapBaud(int baud)
     {
       switch (baud)
@@ -221,12 +504,91 @@
         case 38400: return B38400;
         case 57600: return B57600;
         case 115200: return B115200;
-        default: return B9600;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 1000000: return B1000000;
+        case 2000000: return B2000000;
+        default: return B0;
+      }
+    }
+    // copy of the original settings for OnSignal(), which may only use async-signal-safe calls
+    struct SavedLatency { int fd, flags; char path[PATH_MAX]; char timer[16]; };
+    static SavedLatency& Saved() { static SavedLatency saved = { -1, -1, "", "" }; return saved; }
+    static void OnSignal(int sig)
+    {
+      SavedLatency& saved = Saved();
+      if (saved.fd >= 0 && saved.flags >= 0)
+      {
+        serial_struct ss;
+        if (ioctl(saved.fd, TIOCGSERIAL, &ss) == 0) { ss.flags = saved.flags; ioctl(saved.fd, TIOCSSERIAL, &ss); }
+      }
+      if (saved.fd >= 0 && saved.timer[0] != 0)
+      {
+        int fd = ::open(saved.path, O_WRONLY);
+        if (fd >= 0) { ssize_t n = ::write(fd, saved.timer, std::strlen(saved.timer)); (void)n; ::close(fd); }
+      }
+      signal(sig, SIG_DFL);                     // end the program as the signal would have
+      raise(sig);
+    }
+    void RestoreLatency()
+    {
+      Saved().fd = -1;                          // the signal handler has nothing left to do
+      if (m_serialflags >= 0)
+      {
+        serial_struct ss;
+        if (ioctl(m_fd, TIOCGSERIAL, &ss) == 0) { ss.flags = m_serialflags; ioctl(m_fd, TIOCSSERIAL, &ss); }
+        m_serialflags = -1;
       }
+      if (m_latencytimer >= 0)
+      {
+        std::ofstream out(m_latencypath);
+        out << m_latencytimer << std::flush;
+        m_latencytimer = -1;
+      }
+      m_lowlatency = false;
     }
     int m_fd;
     termios m_orig;
     std::string m_device;
+    CTrace* m_trace;
+    bool m_lowlatency;
+    int m_serialflags, m_latencytimer;          // original settings, -1 if unchanged
+    std::string m_latencypath;
+  };
+
+  class CImageFile                                // read-only memory mapping of an image file
+  {
+  public:
+    CImageFile() { m_data = nullptr; m_size = 0; }
+    ~CImageFile() { Close(); }
+    bool Open(const std::string& filename)
+    {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { ::close(fd); return false; }
+      m_size = size_t(st.st_size);
+      if (m_size > 0)
+      {
+        void* p = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+        if (p == MAP_FAILED) { ::close(fd); m_size = 0; return false; }
+        madvise(p, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const unsigned char*>(p);
+      }
+      ::close(fd); // the mapping stays valid
+      return true;
+    }
+    void Close()
+    {
+      if (m_data != nullptr) munmap(const_cast<unsigned char*>(m_data), m_size);
+      m_data = nullptr; m_size = 0;
+    }
+    const unsigned char* Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+  private:
+    const unsigned char* m_data;
+    size_t m_size;
   };
 
 #else
@@ -240,14 +602,34 @@ void helpscreen()
     std::cout << "Usage (Windows version): prom <file> [<portnum>]\n";
     std::cout << "Writes the binary content of <file> to SST39SF0x0A FLASH.\n";
     std::cout << "Optional: Specify COM <portnum> manually (example: 1).\n";
-    std::cout << "All data is read back and verified.\n";
+    std::cout << "Each chunk is read back and verified right after writing, runs of 0xff are only checked blank.\n";
+    std::cout << "Usage: prom -m <manifest> [<portnum>]\n";
+    std::cout << "Programs a batch of chips, one manifest line each: <file> [<device>] [copies=<n>] [retries=<n>] [compare].\n";
+    std::cout << "With 'compare', chips that already hold the image are left untouched.\n";
+    std::cout << "Option: --trace=<tracefile> records all serial traffic, prom -a <tracefile> analyzes it.\n";
+    std::cout << "Usage: prom -v <file> [<portnum>] compares the chip with <file> per 4KB sector, nothing is erased or written.\n";
+    std::cout << "Usage: prom -x [<portnum>] measures latency and throughput of the serial link, the chip is not touched.\n";
+    std::cout << "Usage: prom -l lists the present COM ports.\n";
+    std::cout << "Usage: prom -c <file> [<file> ...]\n";
+    std::cout << "Prints SHA-256, CRC-32C, 16-bit sum and bytesize of each <file> (-s: also per 4KB sector).\n";
     std::cout << "Press Ctrl+C to exit.\n" << std::flush;
   #elif defined(__linux__)
     std::cout << "Linux version:\n";
     std::cout << "Usage: ./prom <file> [<portname>]\n";
     std::cout << "Writes the binary content of <file> to SST39SF0x0A FLASH.\n";
-    std::cout << "Optional: Specify serial <portname> manually (example: /dev/ttyUSB0).\n";
-    std::cout << "All data is read back and verified.\n";
+    std::cout << "Optional: Specify serial <portname> manually (example: /dev/ttyUSB0) or by the adapter's USB serial number.\n";
+    std::cout << "With several programmers connected, the port must be given.\n";
+    std::cout << "Each chunk is read back and verified right after writing, runs of 0xff are only checked blank.\n";
+    std::cout << "Usage: ./prom -m <manifest> [<portname>]\n";
+    std::cout << "Programs a batch of chips, one manifest line each: <file> [<device>] [copies=<n>] [retries=<n>] [compare].\n";
+    std::cout << "With 'compare', chips that already hold the image are left untouched.\n";
+    std::cout << "Option: --trace=<tracefile> records all serial traffic, ./prom -a <tracefile> analyzes it.\n";
+    std::cout << "Option: --lowlatency tunes USB-serial adapters for short round trips (restored on exit and on Ctrl+C).\n";
+    std::cout << "Usage: ./prom -v <file> [<portname>] compares the chip with <file> per 4KB sector, nothing is erased or written.\n";
+    std::cout << "Usage: ./prom -x [<portname>] measures latency and throughput of the serial link, the chip is not touched.\n";
+    std::cout << "Usage: ./prom -l lists the connected programmers (USB VID:PID and serial number).\n";
+    std::cout << "Usage: ./prom -c <file> [<file> ...]\n";
+    std::cout << "Prints SHA-256, CRC-32C, 16-bit sum and bytesize of each <file> (-s: also per 4KB sector).\n";
     std::cout << "Press Ctrl+C to exit.\n" << std::flush;
   #else
     #error Platform not supported
@@ -259,118 +641,1077 @@ int dt_millis(std::chrono::time_point<std::chrono::steady_clock> t1, std::chrono
   return std::chrono::duration_cast<std::chrono::milliseconds>(t1 - t0).count();
 }
 
-int main(int argc, char* argv[])
-{		
-  #if defined(_WIN32)
-    SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), 0b111); // enable CSI sequences on Windows
-  #endif	
+std::string Hex(uint32_t value, int digits)
+{
+  static const char* hexdigits = "0123456789abcdef";
+  std::string s(digits, '0');
+  for (int i = digits - 1; i >= 0; --i, value >>= 4) s[i] = hexdigits[value & 15];
+  return s;
+}
 
-  std::cout << "\nSST39SF0x0A FLASH Programmer v2.2\nWritten by C. Herting (slu4) 2023-2025\n\n" << std::flush;
-  if (argc < 2) { helpscreen(); return 1; }
+int Sum16(const unsigned char* data, int len)
+{
+  unsigned int sum = 0;
+  for (int i = 0; i < len; ++i) sum += data[i];
+  return sum & 0xffff;
+}
 
-  std::cout << "o Loading image file... " << std::flush;
-  std::ifstream file(argv[1], std::ios::binary);
-  if (!file) { std::cout << "ERROR: Can't open file '" << argv[1] << "'\n" << std::flush; return 1; }
+// CRC-16/XMODEM as computed by _crc_xmodem_update() on the Arduino: protects frames and acknowledges written chunks
+uint16_t Crc16(const unsigned char* data, int len)
+{
+  uint16_t crc = 0;
+  for (int i = 0; i < len; ++i)
+  {
+    crc ^= uint16_t(data[i] << 8);
+    for (int k = 0; k < 8; ++k) crc = (crc & 0x8000) ? uint16_t((crc << 1) ^ 0x1021) : uint16_t(crc << 1);
+  }
+  return crc;
+}
 
-  file.seekg(0, file.end);
-  int bytesize = int(file.tellg());
-  file.seekg(0, file.beg);
+// CRC-32C (Castagnoli, reflected polynomial 0x82F63B78) is used because SSE4.2 and ARMv8 compute it in hardware
+class CCrc32c
+{
+public:
+  static uint32_t Update(uint32_t crc, const unsigned char* data, size_t len)
+  {
+    #if defined(__x86_64__) || defined(__i386__)
+      static const bool hw = __builtin_cpu_supports("sse4.2");
+      if (hw) return UpdateHW(crc, data, len);
+    #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+      return UpdateHW(crc, data, len);
+    #endif
+    return UpdateSW(crc, data, len);
+  }
+  static uint32_t Compute(const unsigned char* data, size_t len) { return Update(0, data, len); }
+private:
+  static uint32_t UpdateSW(uint32_t crc, const unsigned char* data, size_t len)
+  {
+    static const Table t;                       // slicing-by-8 tables
+    crc = ~crc;
+    while (len >= 8)
+    {
+      uint32_t lo = crc ^ (data[0] | data[1] << 8 | data[2] << 16 | uint32_t(data[3]) << 24);
+      crc = t.v[7][lo & 0xff] ^ t.v[6][(lo >> 8) & 0xff] ^ t.v[5][(lo >> 16) & 0xff] ^ t.v[4][lo >> 24] ^
+            t.v[3][data[4]] ^ t.v[2][data[5]] ^ t.v[1][data[6]] ^ t.v[0][data[7]];
+      data += 8; len -= 8;
+    }
+    while (len-- > 0) crc = t.v[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+  }
+  #if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.2"))) static uint32_t UpdateHW(uint32_t crc, const unsigned char* data, size_t len)
+    {
+      crc = ~crc;
+      #if defined(__x86_64__)
+        while (len >= 8) { uint64_t v; std::memcpy(&v, data, 8); crc = uint32_t(_mm_crc32_u64(crc, v)); data += 8; len -= 8; }
+      #endif
+      while (len-- > 0) crc = _mm_crc32_u8(crc, *data++);
+      return ~crc;
+    }
+  #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+    static uint32_t UpdateHW(uint32_t crc, const unsigned char* data, size_t len)
+    {
+      crc = ~crc;
+      while (len >= 8) { uint64_t v; std::memcpy(&v, data, 8); crc = __crc32cd(crc, v); data += 8; len -= 8; }
+      while (len-- > 0) crc = __crc32cb(crc, *data++);
+      return ~crc;
+    }
+  #endif
+  struct Table
+  {
+    uint32_t v[8][256];
+    Table()
+    {
+      for (int i = 0; i < 256; ++i)
+      {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+        v[0][i] = c;
+      }
+      for (int i = 0; i < 256; ++i)
+        for (int k = 1; k < 8; ++k) v[k][i] = (v[k - 1][i] >> 8) ^ v[0][v[k - 1][i] & 0xff];
+    }
+  };
+};
 
-  std::vector<char> filebuf(bytesize);
-  file.read(filebuf.data(), bytesize);
-  file.close();
-  std::cout << bytesize << " bytes\n" << std::flush;
+class CSha256
+{
+public:
+  CSha256()
+  {
+    static const uint32_t init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+    std::memcpy(mState, init, sizeof(mState));
+    mLength = 0; mFill = 0;
+  }
+  void Update(const unsigned char* data, size_t len)
+  {
+    mLength += len;
+    if (mFill > 0)
+    {
+      size_t n = std::min(len, size_t(64 - mFill));
+      std::memcpy(mBlock + mFill, data, n);
+      mFill += int(n); data += n; len -= n;
+      if (mFill < 64) return;
+      Transform(mBlock); mFill = 0;
+    }
+    for (; len >= 64; data += 64, len -= 64) Transform(data);
+    std::memcpy(mBlock, data, len); mFill = int(len);
+  }
+  std::string Final()
+  {
+    uint64_t bits = mLength * 8;
+    unsigned char pad[72] = { 0x80 };
+    size_t n = (mFill < 56 ? 56 : 120) - mFill;
+    for (int i = 0; i < 8; ++i) pad[n + i] = (unsigned char)(bits >> (56 - 8 * i));
+    Update(pad, n + 8);
+    std::string hex;
+    for (uint32_t w : mState) hex += Hex(w, 8);
+    return hex;
+  }
+private:
+  static uint32_t Ror(uint32_t x, int n) { return (x >> n) | (x << (32 - n)); }
+  void Transform(const unsigned char* p)
+  {
+    static const uint32_t k[64] =
+    {
+      0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+      0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+      0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+      0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+      0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+      0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+      0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+      0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+    };
+    uint32_t w[64];
+    for (int i = 0; i < 16; ++i) w[i] = uint32_t(p[4 * i]) << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+    for (int i = 16; i < 64; ++i)
+    {
+      uint32_t s0 = Ror(w[i - 15], 7) ^ Ror(w[i - 15], 18) ^ (w[i - 15] >> 3);
+      uint32_t s1 = Ror(w[i - 2], 17) ^ Ror(w[i - 2], 19) ^ (w[i - 2] >> 10);
+      w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = mState[0], b = mState[1], c = mState[2], d = mState[3], e = mState[4], f = mState[5], g = mState[6], h = mState[7];
+    for (int i = 0; i < 64; ++i)
+    {
+      uint32_t t1 = h + (Ror(e, 6) ^ Ror(e, 11) ^ Ror(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+      uint32_t t2 = (Ror(a, 2) ^ Ror(a, 13) ^ Ror(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+      h = g; g = f; f = e; e = d + t1; d = c; c = b; b = a; a = t1 + t2;
+    }
+    mState[0] += a; mState[1] += b; mState[2] += c; mState[3] += d; mState[4] += e; mState[5] += f; mState[6] += g; mState[7] += h;
+  }
+  uint32_t mState[8];
+  uint64_t mLength;
+  unsigned char mBlock[64];
+  int mFill;
+};
+
+struct SectorHash { uint32_t crc; int sum; };
+
+// CRC-32C and 16-bit sum of the whole image and of every 4KB sector (the last sector may be partial), <sha> is fed in the same pass
+void HashSectors(const unsigned char* data, size_t size, uint32_t& crc, int& sum, std::vector<SectorHash>* sectors, CSha256* sha = nullptr)
+{
+  crc = 0; sum = 0;
+  for (size_t pos = 0; pos < size; pos += SECTORSIZE)
+  {
+    size_t len = std::min(size - pos, size_t(SECTORSIZE));
+    const unsigned char* p = data + pos;
+    if (sha) sha->Update(p, len);
+    crc = CCrc32c::Update(crc, p, len);
+    int s = Sum16(p, int(len));
+    sum = (sum + s) & 0xffff;
+    if (sectors) sectors->push_back({ CCrc32c::Compute(p, len), s });
+  }
+}
+
+// as HashSectors(), also returns the SHA-256 of the image
+std::string HashImage(const unsigned char* data, size_t size, uint32_t& crc, int& sum, std::vector<SectorHash>* sectors)
+{
+  CSha256 sha;
+  HashSectors(data, size, crc, sum, sectors, &sha);
+  return sha.Final();
+}
+
+int Checksum(int argc, char* argv[], bool persector)
+{
+  int failed = 0;
+  for (int i = 2; i < argc; ++i)
+  {
+    CImageFile image;
+    if (!image.Open(argv[i])) { std::cout << "ERROR: Can't open file '" << argv[i] << "'\n" << std::flush; ++failed; continue; }
+    uint32_t crc; int sum;
+    std::vector<SectorHash> sectors;
+    std::string sha = HashImage(image.Data(), image.Size(), crc, sum, persector ? &sectors : nullptr);
+    std::cout << "sha256=" << sha << " crc32c=" << Hex(crc, 8) << " sum16=" << Hex(sum, 4)
+              << " size=" << image.Size() << " " << argv[i] << "\n";
+    for (size_t k = 0; k < sectors.size(); ++k)
+      std::cout << "  sector " << k << " @" << Hex(uint32_t(k * SECTORSIZE), 5) << " crc32c=" << Hex(sectors[k].crc, 8)
+                << " sum16=" << Hex(sectors[k].sum, 4) << "\n";
+  }
+  std::cout << std::flush;
+  return (failed == 0 ? 0 : 1);
+}
+
+struct PlanItem { int pos, len, crc; bool blank; };  // a chunk to write or a run of 0xff to blank-check, never crossing a sector
+
+// everything the write loop needs from an image, built by a worker thread while the port settles and the chip erases
+struct ImagePlan
+{
+  std::vector<PlanItem> items;                  // in address order
+  std::vector<unsigned char> frames;            // write payloads <adr:3> <data>, 3 + CHUNKSIZE bytes per item
+  std::vector<SectorHash> sectors;
+  uint32_t crc; int sum, bytesize, blank;       // blank: bytes that aren't sent because the erased chip already holds them
+};
+
+ImagePlan PrepareImage(const unsigned char* data, int bytesize)
+{
+  ImagePlan plan;
+  plan.bytesize = bytesize; plan.blank = 0;
+  HashSectors(data, bytesize, plan.crc, plan.sum, &plan.sectors);
+  for (int pos = 0; pos < bytesize; )
+  {
+    int end = pos;                              // extend the 0xff run up to the end of the sector
+    while (end < bytesize && data[end] == 0xff && (end == pos || end % SECTORSIZE != 0)) ++end;
+    if (end - pos >= MINBLANK) { plan.items.push_back({ pos, end - pos, 0, true }); plan.blank += end - pos; pos = end; continue; }
+    int len = std::min({ CHUNKSIZE, bytesize - pos, SECTORSIZE - pos % SECTORSIZE });
+    plan.items.push_back({ pos, len, Crc16(data + pos, len), false });
+    pos += len;
+  }
+  plan.frames.resize(plan.items.size() * (3 + CHUNKSIZE));
+  for (size_t k = 0; k < plan.items.size(); ++k)
+  {
+    const PlanItem& it = plan.items[k];
+    if (it.blank) continue;
+    unsigned char* f = &plan.frames[k * (3 + CHUNKSIZE)];
+    f[0] = (unsigned char)it.pos; f[1] = (unsigned char)(it.pos >> 8); f[2] = (unsigned char)(it.pos >> 16);
+    std::memcpy(f + 3, data + it.pos, it.len);
+  }
+  return plan;
+}
+
+// Framed protocol: <SOF> <type> <seq> <len> <payload> <crc16 lo> <crc16 hi>, CRC-16/XMODEM over type..payload.
+// Every request is answered with a frame of the same type and seq, or 'N' if it arrived damaged.
+// One CLink lives as long as its open port, so sequence numbers stay unique and late answers stay in its buffer.
+struct Frame { unsigned char type, seq; std::vector<unsigned char> data; };
+
+class CLink
+{
+public:
+  CLink(CSerial& com) : mCom(com), mSeq(0), mDamaged(0) {}
+  unsigned char Send(char type, const unsigned char* data, int len)      // returns the sequence number used
+  {
+    unsigned char seq = mSeq++;
+    std::string frame = { char(SOF), type, char(seq), char(len) };
+    frame.append(reinterpret_cast<const char*>(data), len);
+    uint16_t crc = Crc16(reinterpret_cast<const unsigned char*>(frame.data()) + 1, len + 3);
+    frame += char(crc & 0xff); frame += char(crc >> 8);
+    mCom.SendData(frame);
+    return seq;
+  }
+  bool Receive(Frame& frame, int timeout)    // waits for the next intact frame, damaged ones are skipped
+  {
+    auto t0 = std::chrono::steady_clock::now();
+    for (;;)
+    {
+      if (Extract(mBuf, frame, mDamaged)) return true;
+      if (!Fill() && dt_millis(std::chrono::steady_clock::now(), t0) >= timeout) return false;
+    }
+  }
+  // raw 'a' -> 'A' handshake, answered by the sketch whenever it is outside a frame; late frames are dropped
+  bool Handshake(int timeout)
+  {
+    mCom.SendByte('a');
+    auto t0 = std::chrono::steady_clock::now();
+    std::string raw;
+    for (;;)
+    {
+      Frame frame;
+      while (Extract(mBuf, frame, mDamaged, &raw)) {}
+      if (raw.find('A') != std::string::npos) return true;
+      if (!Fill() && dt_millis(std::chrono::steady_clock::now(), t0) >= timeout) return false;
+    }
+  }
+  void Flush() { mCom.Flush(); mBuf.clear(); }     // drops everything received so far
+  CSerial& Port() { return mCom; }
+  // sends a request until its answer arrives, resending after a NAK or timeout
+  bool Request(char type, const unsigned char* data, int len, Frame& reply, int timeout, int tries = 4)
+  {
+    for (int t = 0; t < tries; ++t)
+    {
+      unsigned char seq = Send(type, data, len);
+      auto t0 = std::chrono::steady_clock::now();
+      int left;
+      while ((left = timeout - dt_millis(std::chrono::steady_clock::now(), t0)) > 0 && Receive(reply, left))
+      {
+        if (reply.seq != seq) continue;             // late answer to an earlier request
+        if (reply.type == 'N') break;
+        return true;
+      }
+    }
+    return false;
+  }
+  int Damaged() const { return mDamaged; }
+  // takes the next intact frame out of <buf>, counts damaged ones and collects the bytes outside frames in <raw>
+  static bool Extract(std::vector<unsigned char>& buf, Frame& frame, int& damaged, std::string* raw = nullptr)
+  {
+    while (!buf.empty())
+    {
+      if (buf[0] != SOF) { if (raw) *raw += char(buf[0]); buf.erase(buf.begin()); continue; }
+      if (buf.size() < 4) break;
+      size_t len = buf[3];
+      if (len > MAXPAYLOAD) { ++damaged; buf.erase(buf.begin()); continue; }
+      if (buf.size() < len + 6) break;
+      if (Crc16(&buf[1], int(len) + 3) != (buf[len + 4] | buf[len + 5] << 8)) { ++damaged; buf.erase(buf.begin()); continue; }
+      frame.type = buf[1]; frame.seq = buf[2];
+      frame.data.assign(buf.begin() + 4, buf.begin() + 4 + len);
+      buf.erase(buf.begin(), buf.begin() + len + 6);
+      return true;
+    }
+    return false;
+  }
+  static const unsigned char SOF = 0xa5;
+  static const int MAXPAYLOAD = 64;
+private:
+  bool Fill()                                     // appends what the port has received, false if nothing
+  {
+    unsigned char tmp[256];
+    int n = mCom.ReadData(tmp, sizeof(tmp));
+    if (n > 0) mBuf.insert(mBuf.end(), tmp, tmp + n);
+    return n > 0;
+  }
+  CSerial& mCom;
+  unsigned char mSeq;
+  std::vector<unsigned char> mBuf;
+  int mDamaged;
+};
+
+// removes "--<name>" or "--<name>=<value>" from the command line and tells whether it was present
+bool TakeOption(int& argc, char* argv[], const std::string& name, std::string* value = nullptr)
+{
+  for (int i = 1; i < argc; ++i)
+  {
+    std::string arg = argv[i];
+    if (arg != "--" + name && arg.compare(0, name.size() + 3, "--" + name + "=") != 0) continue;
+    if (value != nullptr && arg.size() > name.size() + 2) *value = arg.substr(name.size() + 3);
+    for (int k = i; k < argc - 1; ++k) argv[k] = argv[k + 1];
+    --argc;
+    return true;
+  }
+  return false;
+}
+
+std::string Millis(double us)
+{
+  std::ostringstream s;
+  s.setf(std::ios::fixed); s.precision(1);
+  s << us / 1000.0 << " ms";
+  return s.str();
+}
+
+std::string Stats(std::vector<double> us)           // min / median / p99 / max of a list of microsecond values
+{
+  if (us.empty()) return "-";
+  std::sort(us.begin(), us.end());
+  return "min " + Millis(us.front()) + ", median " + Millis(us[us.size() / 2]) +
+         ", p99 " + Millis(us[std::min(us.size() - 1, us.size() * 99 / 100)]) + ", max " + Millis(us.back());
+}
+
+// rebuilds phase timings, round trip latencies, gaps between answer frames and stalls from a --trace file
+// requests and answers are paired by their frame sequence number, the raw 'a'/'A' handshake by order
+int AnalyzeTrace(const char* filename)
+{
+  const double STALL = 100000.0;                     // silence on the line that counts as a stall (us)
+  CImageFile file;
+  if (!file.Open(filename) || file.Size() < 8 || std::memcmp(file.Data(), "PROMTRC1", 8) != 0)
+  {
+    std::cout << "ERROR: Can't read trace file '" << filename << "'\n" << std::flush; return 1;
+  }
+  struct Phase
+  {
+    std::string name; double start, end; long tx, rx; int unanswered, damaged;
+    std::vector<double> rtt, gaps; std::vector<std::pair<double, double>> stalls;
+  };
+  std::vector<Phase> phases(1, { "start", 0, 0, 0, 0, 0, 0, {}, {}, {} });
+  const unsigned char* p = file.Data() + 8;
+  const unsigned char* end = file.Data() + file.Size();
+  std::vector<unsigned char> txbuf, rxbuf;          // frames may be split across records
+  double pending[256];                              // send time of the unanswered request per sequence number
+  std::fill(pending, pending + 256, -1.0);
+  double lastdata = -1, lastraw = -1, lastanswer = -1;
+  long records = 0;
+  while (end - p >= 11)
+  {
+    char dir = char(p[0]);
+    int len = p[1] | p[2] << 8;
+    uint64_t t = 0;
+    for (int i = 0; i < 8; ++i) t |= uint64_t(p[3 + i]) << (8 * i);
+    if (end - p < 11 + len) break;
+    const char* payload = reinterpret_cast<const char*>(p + 11);
+    p += 11 + len;
+    ++records;
+    Phase& ph = phases.back();
+    ph.end = double(t);
+    if (dir == CTrace::MARK)
+    {
+      phases.push_back({ std::string(payload, len), double(t), double(t), 0, 0, 0, 0, {}, {}, {} });
+      lastanswer = -1;
+      continue;
+    }
+    if (lastdata >= 0 && t - lastdata >= STALL) ph.stalls.push_back({ lastdata, t - lastdata });
+    lastdata = double(t);
+    std::vector<unsigned char>& buf = dir == CTrace::TX ? txbuf : rxbuf;
+    buf.insert(buf.end(), payload, payload + len);
+    Frame f;
+    std::string raw;
+    int damaged = 0;
+    if (dir == CTrace::TX)
+    {
+      ph.tx += len;
+      while (CLink::Extract(buf, f, damaged, &raw))
+      {
+        if (pending[f.seq] >= 0) ++ph.unanswered;     // the sequence number came round again without an answer
+        pending[f.seq] = double(t);
+      }
+      if (!raw.empty()) lastraw = double(t);        // handshake 'a'
+    }
+    else
+    {
+      ph.rx += len;
+      while (CLink::Extract(buf, f, damaged, &raw))
+      {
+        if (pending[f.seq] >= 0) { ph.rtt.push_back(t - pending[f.seq]); pending[f.seq] = -1; }
+        if (lastanswer >= 0) ph.gaps.push_back(t - lastanswer);
+        lastanswer = double(t);
+      }
+      if (!raw.empty() && lastraw >= 0) { ph.rtt.push_back(t - lastraw); lastraw = -1; }
+      ph.damaged += damaged;
+    }
+  }
+  std::cout.setf(std::ios::fixed); std::cout.precision(3);
+  long tx = 0, rx = 0;
+  for (const Phase& ph : phases) { tx += ph.tx; rx += ph.rx; }
+  std::cout << filename << ": " << records << " records, " << phases.back().end / 1e6 << " s, TX " << tx << " bytes, RX " << rx << " bytes\n";
+  for (const Phase& ph : phases)
+  {
+    if (ph.name == "start" && ph.tx == 0 && ph.rx == 0) continue;
+    double dt = std::max(ph.end - ph.start, 1.0);
+    std::cout << "\n[" << ph.name << "] @" << ph.start / 1e6 << " s, " << dt / 1e6 << " s, TX " << ph.tx << " bytes, RX " << ph.rx << " bytes";
+    if (dt >= 10000.0) std::cout << " (" << long(ph.tx * 1e6 / dt) << " / " << long(ph.rx * 1e6 / dt) << " B/s)";
+    std::cout << "\n";
+    if (!ph.rtt.empty()) std::cout << "  round trips " << ph.rtt.size() << ": " << Stats(ph.rtt) << "\n";
+    if (!ph.gaps.empty()) std::cout << "  answer gaps: " << Stats(ph.gaps) << "\n";
+    if (ph.unanswered > 0 || ph.damaged > 0) std::cout << "  unanswered requests " << ph.unanswered << ", damaged answers " << ph.damaged << "\n";
+    for (const auto& st : ph.stalls) std::cout << "  stall " << Millis(st.second) << " @" << st.first / 1e6 << " s\n";
+  }
+  std::cout << std::flush;
+  return 0;
+}
+
+struct ChipType { int id; const char* name; int bytesize; };
+const ChipType CHIPS[] = { { 0xb5, "SST39SF010A", 0x20000 }, { 0xb6, "SST39SF020A", 0x40000 }, { 0xb7, "SST39SF040", 0x80000 } };
+
+const ChipType* FindChip(int id)
+{
+  for (const ChipType& c : CHIPS) if (c.id == id) return &c;
+  return nullptr;
+}
+
+const ChipType* FindChip(std::string name)               // accepts "SST39SF010A", "sst39sf010", "010", ...
+{
+  for (char& c : name) c = char(toupper(c));
+  for (const ChipType& c : CHIPS)
+  {
+    std::string full = c.name;
+    if (name == full || name + "A" == full || "SST39SF" + name == full || "SST39SF" + name + "A" == full) return &c;
+  }
+  return nullptr;
+}
 
+bool OpenPort(CSerial& com, const char* portarg, bool lowlatency)
+{
   std::cout << "o Opening serial port... " << std::flush;
-  CSerial com;
   #if defined(_WIN32)
     int port;
-    if (argc > 2) port = std::stoi(argv[2]);
+    if (portarg != nullptr) port = std::stoi(portarg);
     else port = com.GetFirstComPort();
     if (port < 0 || !com.Open(port, 115200))
     {
-      std::cout << "ERROR: Can't open COM port.\n" << std::flush; return 1;
+      std::cout << "ERROR: Can't open COM port.\n" << std::flush; return false;
     }
     std::cout << "COM" << port << "\n" << std::flush;
   #else
     std::string dev;
-    if (argc > 2) dev = std::string(argv[2]);
-    else dev = com.GetFirstComPort();
+    if (portarg != nullptr) dev = CSerial::ResolvePort(portarg);
+    else
+    {
+      std::vector<PortInfo> ports = CSerial::ListPorts();
+      int known = int(std::count_if(ports.begin(), ports.end(), [](const PortInfo& p) { return p.known; }));
+      if (known > 1)                              // never guess which of several programmers to erase
+      {
+        std::cout << "ERROR: " << known << " programmers found, specify the port or USB serial number (see -l).\n" << std::flush;
+        return false;
+      }
+      if (!ports.empty()) dev = ports[0].device;
+    }
     if (dev.empty() || !com.Open(dev, 115200))
     {
-      std::cout << "ERROR: Can't open serial device.\n" << std::flush; return 1;
+      std::cout << "ERROR: Can't open serial device.\n" << std::flush; return false;
     }
     std::cout << dev << "\n" << std::flush;
   #endif
-	
-  std::cout << "o Waiting 2 seconds...\n" << std::flush;
-	std::this_thread::sleep_for(std::chrono::seconds(2));
-	com.Flush();
-
-  auto now = std::chrono::steady_clock::now();
-  auto last = now;
 
-	std::cout << "o Looking for programmer... " << std::flush;
-  com.SendByte('a');
-  unsigned char rec = 0;
-  while (com.ReadData(&rec, 1) == 0 && dt_millis(now, last) < 1000)
+  if (lowlatency)
   {
-    now = std::chrono::steady_clock::now();
+    std::cout << "o Low latency mode:\n";
+    for (const std::string& line : com.SetLowLatency()) std::cout << "  " << line << "\n";
+    std::cout << std::flush;
   }
-  if (rec != 'A') { std::cout << "ERROR: Programmer doesn't respond.\n" << std::flush; return 1; }
-  std::cout << "OK\n" << std::flush;
 
-  std::cout << "o Sending bytesize... " << std::flush;
-  com.SendData(std::to_string(bytesize));
-  com.SendByte('b');
+  com.Mark("reset");
+  std::cout << "o Waiting 2 seconds...\n" << std::flush;
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  com.Flush();
+  return true;
+}
+
+// reads the JEDEC manufacturer and device ID (SST: 0xbf) from the chip in the socket
+bool ReadChipID(CLink& link, int& manufacturer, int& device)
+{
+  link.Port().Mark("chip id");
+  if (!link.Handshake(1000)) return false;
+  Frame reply;
+  if (!link.Request('I', nullptr, 0, reply, 1000) || reply.type != 'I' || reply.data.size() < 3) return false;
+  if (reply.data[2] != PROTOCOL) { std::cout << "(sketch speaks protocol " << int(reply.data[2]) << ", expected " << PROTOCOL << ") " << std::flush; return false; }
+  manufacturer = reply.data[0]; device = reply.data[1];
+  return true;
+}
 
-  int recsize = 0;
-  rec = 0;
-  do
+// reads the chip ID, checks it against <expected> (if given) and that <bytesize> bytes fit (unknown chips are accepted)
+// returns "OK", "NOLINK", "WRONGCHIP" or "TOOLARGE", <name> gets the chip name or its raw ID
+std::string DetectChip(CLink& link, int bytesize, const ChipType* expected, std::string& name)
+{
+  int manufacturer, device;
+  std::cout << "o Detecting chip... " << std::flush;
+  if (!ReadChipID(link, manufacturer, device)) { std::cout << "ERROR: Programmer doesn't respond.\n" << std::flush; return "NOLINK"; }
+  const ChipType* chip = manufacturer == 0xbf ? FindChip(device) : nullptr;
+  name = chip ? chip->name : Hex(manufacturer, 2) + ":" + Hex(device, 2);
+  std::cout << (chip ? "" : "unknown ID ") << name << "\n" << std::flush;
+  if (expected && chip != expected) { std::cout << "ERROR: Expected " << expected->name << ".\n" << std::flush; return "WRONGCHIP"; }
+  if (chip && bytesize > chip->bytesize) { std::cout << "ERROR: Image doesn't fit into " << chip->name << ".\n" << std::flush; return "TOOLARGE"; }
+  return "OK";
+}
+
+// writes and verifies the given plan items ('B' blank-checks 0xff runs), collects the sectors that still fail
+// returns the number of bad items or -1 if the transfer failed
+int WritePlan(CLink& link, const ImagePlan& plan, const std::vector<int>& items, int maxretries,
+              int& retries, int& resent, std::vector<int>& badsectors, const std::string& label)
+{
+  struct Sent { int item, tries, sends; unsigned char seq; std::chrono::steady_clock::time_point sent; };
+  std::vector<Sent> inflight;                   // items sent but not yet acknowledged
+  int total = 0, done = 0, oldper = -1, errors = 0;
+  for (int k : items) total += plan.items[k].len;
+  auto send = [&](Sent& s)
+  {
+    const PlanItem& it = plan.items[s.item];
+    if (it.blank)
+    {
+      unsigned char check[5] = { (unsigned char)it.pos, (unsigned char)(it.pos >> 8), (unsigned char)(it.pos >> 16),
+                                 (unsigned char)it.len, (unsigned char)(it.len >> 8) };
+      s.seq = link.Send('B', check, 5);
+    }
+    else s.seq = link.Send('W', &plan.frames[s.item * (3 + CHUNKSIZE)], 3 + it.len);
+    s.sent = std::chrono::steady_clock::now();
+    ++s.sends;
+  };
+  auto resend = [&](Sent& s)                    // the frame, its answer or both got damaged or lost
+  {
+    if (s.sends >= MAXSENDS) { std::cout << "\nERROR: Programmer doesn't acknowledge data.\n" << std::flush; return false; }
+    ++resent; send(s);
+    return true;
+  };
+  auto fail = [&](const Sent& s)
   {
-    if (com.ReadData(&rec, 1) == 1 && rec >= '0' && rec <= '9') recsize = recsize * 10 + (rec - '0');
-  } while (rec != 'B');
+    ++errors;
+    int sector = plan.items[s.item].pos / SECTORSIZE * SECTORSIZE;
+    if (std::find(badsectors.begin(), badsectors.end(), sector) == badsectors.end()) badsectors.push_back(sector);
+  };
 
-  if (recsize != bytesize) { std::cout << "ERROR: Programmer doesn't confirm bytesize.\n" << std::flush; return 1; }
+  std::cout << "\e[G" << label << "..." << std::flush;
+  size_t next = 0;
+  while (next < items.size() || !inflight.empty())
+  {
+    while (int(inflight.size()) < WINDOW && next < items.size())
+    {
+      Sent s = { items[next++], 0, 0, 0, {} };
+      send(s);
+      inflight.push_back(s);
+    }
+    // *** the Arduino ACKs each chunk with the CRC-16 of what it has read back, each 0xff run with [ok] ***
+    Frame f;
+    if (link.Receive(f, 10))
+    {
+      auto it = std::find_if(inflight.begin(), inflight.end(), [&](const Sent& s) { return s.seq == f.seq; });
+      if (it == inflight.end()) continue;         // late answer to an item that has been resent
+      const PlanItem& item = plan.items[it->item];
+      if (f.type == 'W' && f.data.size() == 2 && !item.blank)
+      {
+        if ((f.data[0] | (f.data[1] << 8)) == item.crc) { done += item.len; inflight.erase(it); }
+        else if (it->tries++ < maxretries) { ++retries; it->sends = 0; send(*it); }   // rewrite the chunk
+        else { fail(*it); done += item.len; inflight.erase(it); }
+      }
+      else if (f.type == 'B' && f.data.size() == 1 && item.blank)
+      {
+        if (f.data[0] != 1) fail(*it);            // not erased: rewriting 0xff can't help, the sector needs repair
+        done += item.len; inflight.erase(it);
+      }
+      else if (!resend(*it)) return -1;           // 'N': the frame was damaged on its way
+    }
+    for (Sent& s : inflight)
+    {
+      if (dt_millis(std::chrono::steady_clock::now(), s.sent) < 500) continue;
+      if (!resend(s)) return -1;
+    }
+    int per = total > 0 ? int((100LL * done) / total) : 100;
+    if (per != oldper) { std::cout << "\e[G" << label << "... " << per << "%" << std::flush; oldper = per; }
+  }
+  std::cout << (errors == 0 ? " OK\n" : " FAILED\n") << std::flush;
+  std::sort(badsectors.begin(), badsectors.end());
+  return errors;
+}
+
+// erases the FLASH, writes and verifies the image, returns the number of bad items or -1 if the transfer failed
+// the plan is only waited for after the erase, so its preprocessing overlaps the port reset, handshake and erase
+int ProgramImage(CLink& link, std::shared_future<ImagePlan> plan, int maxretries, int& retries)
+{
+  CSerial& com = link.Port();
+  int damaged = link.Damaged();
+  com.Mark("handshake");
+  std::cout << "o Looking for programmer... " << std::flush;
+  if (!link.Handshake(1000)) { std::cout << "ERROR: Programmer doesn't respond.\n" << std::flush; return -1; }
   std::cout << "OK\n" << std::flush;
+
+  Frame reply;
+  com.Mark("erase");
   std::cout << "o Erasing FLASH... " << std::flush;
-  rec = 0;
-  while (com.ReadData(&rec, 1) == 0) {}
-  if (rec != 'C') { std::cout << "ERROR: Programmer can't erase FLASH.\n" << std::flush; return 1; }
+  if (!link.Request('E', nullptr, 0, reply, 5000) || reply.type != 'E' || reply.data.size() != 1 || reply.data[0] != 1)
+  {
+    std::cout << "ERROR: Programmer can't erase FLASH.\n" << std::flush; return -1;
+  }
   std::cout << "OK\n" << std::flush;
-  std::cout << "\e[Go Writing..." << std::flush;
-  int pos = 0, oldper = -1;
 
-  while (pos < bytesize)
+  if (plan.wait_for(std::chrono::seconds(0)) != std::future_status::ready) com.Mark("wait for image");
+  const ImagePlan& p = plan.get();
+  if (p.blank > 0) std::cout << "o Skipping " << p.blank << " bytes of 0xff (checked blank on the chip)\n" << std::flush;
+
+  com.Mark("write");
+  int resent = 0;
+  retries = 0;
+  std::vector<int> bad, all(p.items.size());
+  for (size_t k = 0; k < all.size(); ++k) all[k] = int(k);
+  int errors = WritePlan(link, p, all, maxretries, retries, resent, bad, "o Writing & verifying");
+  if (errors < 0) return -1;
+
+  // *** sector-erase only the sectors with errors and write them again ***
+  for (int round = 1; errors > 0 && round <= MAXREPAIRS; ++round)
+  {
+    com.Mark("repair " + std::to_string(round));
+    std::vector<int> items, stillbad, erased;
+    int unerased = 0;                               // items in sectors that can't even be erased
+    for (int sector : bad)
+    {
+      unsigned char adr[3] = { (unsigned char)sector, (unsigned char)(sector >> 8), (unsigned char)(sector >> 16) };
+      if (!link.Request('S', adr, 3, reply, 1000) || reply.type != 'S')
+      {
+        std::cout << "ERROR: Programmer can't erase sector " << Hex(sector, 5) << ".\n" << std::flush; return -1;
+      }
+      if (reply.data.size() == 1 && reply.data[0] == 1) erased.push_back(sector);
+      else stillbad.push_back(sector);
+    }
+    for (size_t k = 0; k < p.items.size(); ++k)
+    {
+      int sector = p.items[k].pos / SECTORSIZE * SECTORSIZE;
+      if (std::find(erased.begin(), erased.end(), sector) != erased.end()) items.push_back(int(k));
+      else if (std::find(stillbad.begin(), stillbad.end(), sector) != stillbad.end()) ++unerased;
+    }
+    int repairerrors = WritePlan(link, p, items, maxretries, retries, resent, stillbad,
+                                 "o Repairing " + std::to_string(bad.size()) + " sectors (" + std::to_string(round) + "/" + std::to_string(MAXREPAIRS) + ")");
+    if (repairerrors < 0) return -1;
+    errors = repairerrors + unerased;
+    bad = stillbad;
+  }
+
+  link.Request('F', nullptr, 0, reply, 1000);
+  com.Mark("done");
+  if (retries > 0) std::cout << "o Rewritten " << retries << " chunks\n";
+  damaged = link.Damaged() - damaged;
+  if (resent > 0 || damaged > 0) std::cout << "o Link errors: " << resent << " frames resent, " << damaged << " damaged answers\n";
+  if (!bad.empty())
   {
-    int chunk = std::min(32, bytesize - pos);
-    com.SendData(&filebuf[pos], chunk);
-    pos += chunk;
-    // *** wait for the Arduino to ACK this chunk ***
-    while (com.ReadData(&rec, 1) == 0) {}
-    int per = (100 * pos) / bytesize;
-    if (per != oldper) { std::cout << "\e[Go Writing... " << per << "%" << std::flush; oldper = per; }
+    std::cout << "o Bad sectors:";
+    for (int sector : bad) std::cout << " " << Hex(sector, 5);
+    std::cout << "\n";
+  }
+  std::cout << std::flush;
+  return errors;
+}
+
+// has the chip hash the image range sector by sector ('H') and compares with the file, nothing is sent or erased
+// returns the number of differing sectors or -1 if the transfer failed, <quick> stops silently at the first difference
+int CompareImage(CLink& link, const ImagePlan& plan, bool quick)
+{
+  link.Port().Mark("compare");
+  int differ = 0;
+  for (size_t k = 0; k < plan.sectors.size(); ++k)
+  {
+    int pos = int(k) * SECTORSIZE, len = std::min(SECTORSIZE, plan.bytesize - pos);
+    unsigned char range[5] = { (unsigned char)pos, (unsigned char)(pos >> 8), (unsigned char)(pos >> 16), (unsigned char)len, (unsigned char)(len >> 8) };
+    Frame reply;
+    if (!link.Request('H', range, 5, reply, 1000) || reply.type != 'H' || reply.data.size() != 6)
+    {
+      std::cout << "ERROR: Programmer can't hash sector " << Hex(pos, 5) << ".\n" << std::flush; return -1;
+    }
+    const std::vector<unsigned char>& h = reply.data;
+    uint32_t crc = h[0] | (h[1] << 8) | (h[2] << 16) | (uint32_t(h[3]) << 24);
+    int sum = h[4] | (h[5] << 8);
+    bool same = crc == plan.sectors[k].crc && sum == plan.sectors[k].sum;
+    if (!same) ++differ;
+    if (quick) { if (!same) break; continue; }
+    std::cout << "  sector " << k << " @" << Hex(pos, 5) << " crc32c=" << Hex(plan.sectors[k].crc, 8) << " sum16=" << Hex(plan.sectors[k].sum, 4)
+              << (same ? " OK" : " DIFFERENT (chip: crc32c=" + Hex(crc, 8) + " sum16=" + Hex(sum, 4) + ")") << "\n" << std::flush;
+  }
+  return differ;
+}
+
+// compares the chip with an image file without erasing or writing anything
+int Compare(const char* filename, const char* portarg, CTrace* trace, bool lowlatency)
+{
+  std::cout << "o Loading image file... " << std::flush;
+  CImageFile image;
+  if (!image.Open(filename)) { std::cout << "ERROR: Can't open file '" << filename << "'\n" << std::flush; return 1; }
+  int bytesize = int(image.Size());
+  std::cout << bytesize << " bytes\n" << std::flush;
+  std::shared_future<ImagePlan> plan = std::async(std::launch::async, PrepareImage, image.Data(), bytesize).share();
+
+  CSerial com;
+  com.SetTrace(trace);
+  std::string chipname;
+  if (!OpenPort(com, portarg, lowlatency)) return 1;
+  CLink link(com);
+  if (DetectChip(link, bytesize, nullptr, chipname) != "OK") return 1;
+
+  auto t0 = std::chrono::steady_clock::now();
+  std::cout << "o Comparing " << plan.get().sectors.size() << " sectors:\n" << std::flush;
+  int differ = CompareImage(link, plan.get(), false);
+  com.Close();
+  if (differ < 0) return 1;
+  std::cout << "\n" << (differ == 0 ? "MATCH" : std::to_string(differ) + " SECTORS DIFFER") << " ("
+            << dt_millis(std::chrono::steady_clock::now(), t0) << " ms)\n" << std::flush;
+  return (differ == 0 ? 0 : 1);
+}
+
+// measures payload throughput of <frames> link test frames ('Y' upstream, 'Z' downstream) with WINDOW frames in flight
+double Throughput(CLink& link, char type, int chunk, int frames)
+{
+  std::vector<unsigned char> payload(type == 'Y' ? chunk : 1, 0x55);
+  if (type == 'Z') payload[0] = (unsigned char)chunk;
+  std::vector<std::pair<unsigned char, std::chrono::steady_clock::time_point>> inflight;
+  int sent = 0, done = 0, lost = 0;
+  auto t0 = std::chrono::steady_clock::now();
+  while (done < frames)
+  {
+    while (int(inflight.size()) < WINDOW && sent < frames)
+    {
+      inflight.push_back({ link.Send(type, payload.data(), int(payload.size())), std::chrono::steady_clock::now() });
+      ++sent;
+    }
+    Frame f;
+    if (link.Receive(f, 10))
+    {
+      auto it = std::find_if(inflight.begin(), inflight.end(), [&](const std::pair<unsigned char, std::chrono::steady_clock::time_point>& p) { return p.first == f.seq; });
+      if (it == inflight.end()) continue;
+      inflight.erase(it);
+      if (f.type == type) ++done;
+      else { --sent; ++lost; }                      // 'N': send another one instead
+    }
+    for (size_t i = 0; i < inflight.size(); ++i)
+    {
+      if (dt_millis(std::chrono::steady_clock::now(), inflight[i].second) < 500) continue;
+      inflight.erase(inflight.begin() + i--);
+      --sent; ++lost;
+    }
+    if (lost > frames) return -1;
   }
-  std::cout << " OK\n" << std::flush;
+  double us = double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count());
+  return double(chunk) * frames * 1e6 / std::max(us, 1.0);
+}
 
-  std::cout << "\e[Go Verifying..." << std::flush;
-  int errors = 0;
-  pos = 0; oldper = -1;
-  do
+// switches the link to another baud rate; the sketch falls back to 115200 by itself if no frame follows
+bool SwitchBaud(CLink& link, int baud)
+{
+  unsigned char b[4] = { (unsigned char)baud, (unsigned char)(baud >> 8), (unsigned char)(baud >> 16), (unsigned char)(baud >> 24) };
+  Frame reply;
+  if (!link.Request('R', b, 4, reply, 1000) || reply.type != 'R' || reply.data.size() != 1 || reply.data[0] != 1) return false;
+  if (!link.Port().SetBaud(baud)) return false;
+  std::this_thread::sleep_for(std::chrono::milliseconds(20));
+  link.Flush();
+  unsigned char ping = 0x5a;
+  return link.Request('X', &ping, 1, reply, 300, 3) && reply.type == 'X';
+}
+
+// link self-test: latency and raw throughput in both directions at every baud rate and chunk size, the chip is never touched
+int SelfTest(const char* portarg, CTrace* trace, bool lowlatency)
+{
+  CSerial com;
+  com.SetTrace(trace);
+  if (!OpenPort(com, portarg, lowlatency)) return 1;
+  CLink link(com);
+  std::cout << "o Looking for programmer... " << std::flush;
+  if (!link.Handshake(1000)) { std::cout << "ERROR: Programmer doesn't respond.\n" << std::flush; return 1; }
+  std::cout << "OK\n\n" << std::flush;
+
+  const int bauds[] = { 57600, 115200, 230400, 500000, 1000000 };
+  const int chunks[] = { 8, 16, 32, 64 };
+  int failed = 0;
+  std::cout << "   baud  latency min/median/max      chunk   up B/s  (line%)   dn B/s  (line%)\n";
+  for (int baud : bauds)
   {
-    now = std::chrono::steady_clock::now();
-    if (com.ReadData(&rec, 1) == 1)
+    com.Mark("baud " + std::to_string(baud));
+    std::cout << std::string(7 - std::min(7, int(std::to_string(baud).size())), ' ') << baud << "  " << std::flush;
+    if (baud != 115200 && !SwitchBaud(link, baud))
     {
-      if (rec != static_cast<unsigned char>(filebuf[pos])) ++errors;
-      ++pos;
-      last = now;
-      int per = 100 * pos / bytesize;
-      if (per != oldper) { std::cout << "\e[Go Verifying... " << per << "%" << std::flush; oldper = per; }
+      std::cout << "no link\n" << std::flush;
+      ++failed;
+      com.SetBaud(115200);                          // wait for the sketch to fall back
+      std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+      link.Flush();
+      continue;
     }
-  } while (pos < bytesize && dt_millis(now, last) < 1000);
+    std::vector<double> rtt;
+    for (int i = 0; i < 20; ++i)
+    {
+      unsigned char ping = (unsigned char)i;
+      Frame reply;
+      auto t0 = std::chrono::steady_clock::now();
+      if (link.Request('X', &ping, 1, reply, 500, 1) && reply.type == 'X')
+        rtt.push_back(double(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - t0).count()));
+    }
+    std::sort(rtt.begin(), rtt.end());
+    std::string latency = rtt.empty() ? "-" : Millis(rtt.front()) + " / " + Millis(rtt[rtt.size() / 2]) + " / " + Millis(rtt.back());
+    std::cout << latency << std::string(std::max(1, 26 - int(latency.size())), ' ');
+    for (size_t k = 0; k < sizeof(chunks) / sizeof(chunks[0]); ++k)
+    {
+      int chunk = chunks[k];
+      double up = Throughput(link, 'Y', chunk, std::max(16, 2048 / chunk));
+      double down = Throughput(link, 'Z', chunk, std::max(16, 2048 / chunk));
+      if (k > 0) std::cout << std::string(35, ' ');
+      std::cout << std::string(5 - std::to_string(chunk).size(), ' ') << chunk;
+      for (double rate : { up, down })
+      {
+        std::string r = rate < 0 ? "failed" : std::to_string(long(rate));
+        std::string p = rate < 0 ? "" : "(" + std::to_string(long(rate * 1000.0 / baud)) + "%)";
+        std::cout << std::string(std::max(0, 9 - int(r.size())), ' ') << r << std::string(std::max(0, 9 - int(p.size())), ' ') << p;
+        if (rate < 0) ++failed;
+      }
+      std::cout << "\n" << std::flush;
+    }
+    if (baud != 115200 && !SwitchBaud(link, 115200))
+    {
+      com.SetBaud(115200);
+      std::this_thread::sleep_for(std::chrono::milliseconds(1200));
+      link.Flush();
+    }
+  }
+  com.Close();
+  std::cout << "\n(line% = payload rate relative to the raw line rate of baud/10 bytes per second)\n" << std::flush;
+  return (failed == 0 ? 0 : 1);
+}
+
+struct BatchEntry { std::string file; const ChipType* chip; int copies, retries, line; bool compare; };
+
+// manifest lines: <file> [<device>] [copies=<n>] [retries=<n>] [compare], '#' starts a comment
+bool ReadManifest(const std::string& filename, std::vector<BatchEntry>& entries)
+{
+  std::ifstream file(filename);
+  if (!file) { std::cout << "ERROR: Can't open manifest '" << filename << "'\n" << std::flush; return false; }
+  std::string dir;
+  size_t slash = filename.find_last_of("/\\");
+  if (slash != std::string::npos) dir = filename.substr(0, slash + 1);
+  std::string line;
+  for (int n = 1; std::getline(file, line); ++n)
+  {
+    line = line.substr(0, line.find('#'));
+    std::istringstream words(line);
+    std::string word;
+    if (!(words >> word)) continue;
+    BatchEntry e = { word, nullptr, 1, MAXRETRIES, n, false };
+    if (!dir.empty() && e.file[0] != '/' && e.file[0] != '\\' && e.file.find(':') == std::string::npos) e.file = dir + e.file;
+    while (words >> word)
+    {
+      size_t eq = word.find('=');
+      std::string key = word.substr(0, eq), value = eq == std::string::npos ? "" : word.substr(eq + 1);
+      int num = -1;                               // numbers above 9999 are rejected like any unknown option
+      if (!value.empty() && value.size() <= 4 && value.find_first_not_of("0123456789") == std::string::npos) num = int(std::strtol(value.c_str(), nullptr, 10));
+      if (key == "copies" && num > 0) e.copies = num;
+      else if (key == "retries" && num >= 0) e.retries = num;
+      else if (word == "compare") e.compare = true;   // skip chips that already hold the image
+      else if (eq == std::string::npos && (e.chip = FindChip(word)) != nullptr) {}
+      else { std::cout << "ERROR: " << filename << ":" << n << ": Unknown option '" << word << "'\n" << std::flush; return false; }
+    }
+    entries.push_back(e);
+  }
+  if (entries.empty()) { std::cout << "ERROR: Manifest '" << filename << "' is empty.\n" << std::flush; return false; }
+  return true;
+}
+
+int ListProgrammers()
+{
+  std::vector<PortInfo> ports = CSerial::ListPorts();
+  if (ports.empty()) { std::cout << "No serial ports found.\n" << std::flush; return 1; }
+  for (const PortInfo& p : ports)
+  {
+    std::cout << (p.known ? "* " : "  ") << p.device;
+    if (!p.vid.empty()) std::cout << "  " << p.vid << ":" << p.pid;
+    if (!p.serial.empty()) std::cout << "  serial " << p.serial;
+    if (!p.product.empty()) std::cout << "  " << p.product;
+    std::cout << "\n";
+  }
+  std::cout << "(* = known programmer adapter)\n" << std::flush;
+  return 0;
+}
+
+std::string TimeStamp()
+{
+  std::time_t t = std::time(nullptr);
+  char buf[32];
+  std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", std::localtime(&t));
+  return buf;
+}
+
+// programs every entry of the manifest over one open connection and appends the results to <manifest>.log
+int Batch(const char* manifest, const char* portarg, CTrace* trace, bool lowlatency)
+{
+  std::vector<BatchEntry> entries;
+  if (!ReadManifest(manifest, entries)) return 1;
+  int jobs = 0;
+  for (const BatchEntry& e : entries) jobs += e.copies;
+  std::cout << "o Manifest: " << entries.size() << " images, " << jobs << " chips\n" << std::flush;
+
+  std::string logname = std::string(manifest) + ".log";
+  std::ofstream log(logname, std::ios::app);
+  if (!log) { std::cout << "ERROR: Can't write log file '" << logname << "'\n" << std::flush; return 1; }
+  log << "# " << TimeStamp() << " batch " << manifest << "\n";
+  log << "# time entry copy file bytes crc32c chip result errors retries ms\n" << std::flush;
+
+  CSerial com;
+  com.SetTrace(trace);
+  if (!OpenPort(com, portarg, lowlatency)) return 1;
+  CLink link(com);
+
+  int job = 0, good = 0, bad = 0;
+  bool quit = false;
+  for (size_t k = 0; k < entries.size() && !quit; ++k)
+  {
+    const BatchEntry& e = entries[k];
+    CImageFile image;
+    bool loaded = image.Open(e.file);
+    std::shared_future<ImagePlan> plan;             // prepared while the operator inserts the chip
+    if (loaded) plan = std::async(std::launch::async, PrepareImage, image.Data(), int(image.Size())).share();
+    for (int copy = 1; copy <= e.copies && !quit; ++copy)
+    {
+      ++job;
+      com.Mark("operator");
+      std::cout << "\n[" << job << "/" << jobs << "] " << e.file << (e.chip ? std::string(" (") + e.chip->name + ")" : "")
+                << "\nInsert chip and press ENTER (s = skip, q = quit): " << std::flush;
+      std::string answer;
+      if (!std::getline(std::cin, answer) || answer == "q") { log << "# aborted by operator\n"; quit = true; break; }
+      com.Mark("job " + std::to_string(job));
+      auto t0 = std::chrono::steady_clock::now();
+      std::string result = "OK", chipname = "-";
+      int errors = 0, retries = 0;
+      if (answer == "s") result = "SKIPPED";
+      else if (!loaded) { std::cout << "ERROR: Can't open file '" << e.file << "'\n" << std::flush; result = "NOFILE"; }
+      else
+      {
+        result = DetectChip(link, int(image.Size()), e.chip, chipname);
+        if (result == "OK")
+        {
+          int differ = 1;
+          if (e.compare)
+          {
+            std::cout << "o Comparing with image... " << std::flush;
+            differ = CompareImage(link, plan.get(), true);
+            if (differ >= 0) std::cout << (differ == 0 ? "identical\n" : "different\n") << std::flush;
+          }
+          if (differ < 0) { result = "NOLINK"; link.Flush(); }
+          else if (differ == 0) result = "SAME";
+          else
+          {
+            errors = ProgramImage(link, plan, e.retries, retries);
+            if (errors < 0) { result = "NOLINK"; link.Flush(); }
+            else if (errors > 0) result = "ERRORS";
+          }
+        }
+      }
+      if (result == "OK" || result == "SAME") ++good;
+      else if (result != "SKIPPED") ++bad;
+      std::cout << (result == "OK" ? "SUCCESS" : result) << "\n" << std::flush;
+      log << TimeStamp() << " " << k + 1 << " " << copy << " " << e.file << " " << image.Size() << " " << Hex(loaded ? plan.get().crc : 0, 8) << " "
+          << chipname << " " << result << " " << std::max(errors, 0) << " " << retries << " "
+          << dt_millis(std::chrono::steady_clock::now(), t0) << "\n" << std::flush;
+    }
+  }
+  std::cout << "\nBATCH DONE: " << good << " OK, " << bad << " FAILED (log: " << logname << ")\n" << std::flush;
+  log << "# " << TimeStamp() << " done: " << good << " ok, " << bad << " failed\n";
+  com.Close();
+  return (bad == 0 ? 0 : 1);
+}
+
+int main(int argc, char* argv[])
+{
+  #if defined(_WIN32)
+    SetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), 0b111); // enable CSI sequences on Windows
+  #endif
+
+  std::string tracefile;
+  bool tracing = TakeOption(argc, argv, "trace", &tracefile);
+  bool lowlatency = TakeOption(argc, argv, "lowlatency");
+
+  if (argc > 2 && std::string(argv[1]) == "-c") return Checksum(argc, argv, false);
+  if (argc > 2 && std::string(argv[1]) == "-s") return Checksum(argc, argv, true);
+  if (argc > 2 && std::string(argv[1]) == "-a") return AnalyzeTrace(argv[2]);
+
+  std::cout << "\nSST39SF0x0A FLASH Programmer v3.0\nWritten by C. Herting (slu4) 2023-2025\n\n" << std::flush;
+  if (argc < 2) { helpscreen(); return 1; }
+  if (std::string(argv[1]) == "-l") return ListProgrammers();
+
+  CTrace trace;
+  if (tracing && (tracefile.empty() || !trace.Open(tracefile)))
+  {
+    std::cout << "ERROR: Can't write trace file '" << tracefile << "'\n" << std::flush; return 1;
+  }
+  if (std::string(argv[1]) == "-v") { if (argc < 3) { helpscreen(); return 1; } return Compare(argv[2], argc > 3 ? argv[3] : nullptr, &trace, lowlatency); }
+  if (std::string(argv[1]) == "-x") return SelfTest(argc > 2 ? argv[2] : nullptr, &trace, lowlatency);
+  if (std::string(argv[1]) == "-m") { if (argc < 3) { helpscreen(); return 1; } return Batch(argv[2], argc > 3 ? argv[3] : nullptr, &trace, lowlatency); }
+
+  std::cout << "o Loading image file... " << std::flush;
+  CImageFile image;
+  if (!image.Open(argv[1])) { std::cout << "ERROR: Can't open file '" << argv[1] << "'\n" << std::flush; return 1; }
+  int bytesize = int(image.Size());
+  std::cout << bytesize << " bytes\n" << std::flush;
+  std::shared_future<ImagePlan> plan = std::async(std::launch::async, PrepareImage, image.Data(), bytesize).share();
+
+  CSerial com;
+  com.SetTrace(&trace);
+  if (!OpenPort(com, argc > 2 ? argv[2] : nullptr, lowlatency)) return 1;
+
+  CLink link(com);
+  std::string chipname;
+  if (DetectChip(link, bytesize, nullptr, chipname) != "OK") return 1;
 
-  if (pos != bytesize) { std::cout << "\nERROR: File size mismatch.\n" << std::flush; return 1; }
-  std::cout << " OK\n\n";
+  int retries = 0;
+  int errors = ProgramImage(link, plan, MAXRETRIES, retries);
+  if (errors < 0) return 1;
+  std::cout << "\n";
   if (errors == 0) std::cout << "SUCCESS\n" << std::flush;
   else std::cout << errors << " ERRORS\n" << std::flush;
   com.Close();